@@ -1,5 +1,7 @@
 #pragma once
 #include <vector>
+#include <map>
+#include <cstdint>
 #include <cassert>
 
 namespace qcs{
@@ -56,16 +58,71 @@ namespace qasm
         std::vector<int> values;
     };
 
+    /*-------------------------------------------------------
+     * 記号パラメータ（run_batch で値を束縛する）
+     *------------------------------------------------------*/
+    struct param
+    {
+        int id;
+    };
+
+    /*-------------------------------------------------------
+     * ゲート角度: 定数、または scale * param + offset
+     *------------------------------------------------------*/
+    struct angle
+    {
+        int param_id = -1;
+        double scale = 1.0;
+        double offset = 0.0;
+        angle(double v) : offset(v) {}
+        angle(param p) : param_id(p.id) {}
+        bool is_symbolic() const { return param_id >= 0; }
+        double value(const std::vector<double> &binding) const;
+    };
+
+    angle operator*(double k, const angle &a);
+    angle operator*(const angle &a, double k);
+    angle operator+(const angle &a, double c);
+    angle operator+(double c, const angle &a);
+    angle operator-(const angle &a, double c);
+    angle operator-(double c, const angle &a);
+    angle operator-(const angle &a);
+
+    /*-------------------------------------------------------
+     * ノイズモデル（量子軌跡法で評価する）
+     *   ゲート種別ごとのチャネルを、そのゲートが作用する
+     *   全量子ビット（標的と制御）に適用する。
+     *------------------------------------------------------*/
+    struct channel
+    {
+        double depolarizing = 0.0;      // probability of a uniformly random X/Y/Z error
+        double amplitude_damping = 0.0; // decay probability gamma of |1>
+    };
+
+    struct noise_model
+    {
+        channel hadamard;
+        channel x;
+        channel u4;
+        double readout_p01 = 0.0; // P(read 1 | 0)
+        double readout_p10 = 0.0; // P(read 0 | 1)
+    };
+
     class qubits;
     class bit;
+    class observable;
     struct token;
+    struct instruction;
+    struct program;
     class builder;
 
     class qasm
     {
     public:
         inline qasm() = default;
-        inline virtual ~qasm() = default;
+        virtual ~qasm();
+        qasm(const qasm &) = delete;
+        qasm &operator=(const qasm &) = delete;
 
         /*-------------------------------------------------------
          * qubits / bits allocation helper
@@ -73,6 +130,16 @@ namespace qasm
         qubits qalloc(int n);
         bit clalloc(int n);
 
+        /*-------------------------------------------------------
+         * 量子ビットの解放
+         *   measure / reset 済みの量子ビットを状態から切り離し、
+         *   残りの物理スロットを詰め直す（状態は常に密）。
+         *   最後の measure / reset 以降にゲートの標的になった qubit が
+         *   含まれていれば、何も解放せずに std::runtime_error。
+         *------------------------------------------------------*/
+        void qfree(const qubits &qs);
+        void qfree(const indices_t &qs);
+
         /*-------------------------------------------------------
          * 外部 Simulator 登録
          *------------------------------------------------------*/
@@ -83,8 +150,8 @@ namespace qasm
          *------------------------------------------------------*/
         builder h();
         builder x();
-        builder u(double th, double ph, double la);
-        builder cu(double th, double ph, double la, double ga);
+        builder u(angle th, angle ph, angle la);
+        builder cu(angle th, angle ph, angle la, angle ga);
         builder pow(double exp);
         builder inv();
         builder sqrt();
@@ -106,9 +173,67 @@ namespace qasm
         std::vector<int> measure(const qubits &qs);
         std::vector<int> measure(const indices_t &qs);
 
+        // all measurement outcomes of this instance, in measurement order
+        const std::vector<int> &measurements() const { return measured_; }
+
+        /*-------------------------------------------------------
+         * 期待値（状態を壊さずに厳密計算）
+         *   qubit-wise commuting な項をまとめ、グループごとに
+         *   シミュレータの 1 回の縮約パスで評価する。
+         *------------------------------------------------------*/
+        double expectation(const observable &obs);
+
+        /*-------------------------------------------------------
+         * パラメトリック回路のバッチ評価
+         *   circuit() を一度だけ記録し、bindings の各パラメータ組
+         *   (K 組) をバッチとしてシミュレータで同時に評価する。
+         *   戻り値は [K][測定順] の測定結果。
+         *   記録中の measure は常に 0 を返すので、途中の測定結果で
+         *   分岐する回路は誤った経路で記録される。
+         *   記録はインスタンスごとに 1 回だけで、qubit をまだ
+         *   シミュレータへ割り当てていないインスタンスに限る
+         *   (run_trajectories も同じ)。
+         *------------------------------------------------------*/
+        param parameter();
+        std::vector<std::vector<int>> run_batch(const std::vector<std::vector<double>> &bindings);
+
+        // parameter sets for the runner; empty means a plain circuit() run
+        virtual std::vector<std::vector<double>> bindings();
+
+        /*-------------------------------------------------------
+         * ノイズ付きシミュレーション（モンテカルロ量子軌跡法）
+         *   circuit() を記録し、num_trajectories 本の軌跡を
+         *   num_threads 本のワーカーで並列に評価する。誤りが起きる
+         *   までの共通部分は登録済みシミュレータで 1 度だけ計算し、
+         *   各軌跡はそこから状態をコピーして分岐する。
+         *   登録済みシミュレータは qubit を 1 つも持たない初期状態で
+         *   渡すこと（リセットはしない）。
+         *   戻り値は測定結果ごとの出現回数。
+         *------------------------------------------------------*/
+        std::map<std::vector<int>, int> run_trajectories(const noise_model &noise, int num_trajectories, int num_threads, std::uint64_t seed);
+
+        // noise model for the runner's trajectory mode
+        virtual noise_model noise();
+
     private:
+        void record();
+        void execute(instruction &&in);
+        int slot(int qubit);
+        int gate_slot(int qubit);
+
+        // slot_of_ の特殊値: まだ触れていない / qfree 済み
+        enum { unmapped = -1, released = -2 };
+
         qcs::simulator *simulator_ = nullptr;
+        program *program_ = nullptr;
+        bool recording_ = false;
+        std::vector<int> measured_;
+        std::vector<int> slot_of_;
+        // 論理 qubit が計算基底状態にあるか（未使用・measure/reset 後に真、ゲートの標的で偽）
+        std::vector<char> in_basis_;
+        int num_slots_ = 0;
         int next_id_ = 0;
+        int num_params_ = 0;
         friend class builder;
         friend class qubits;
     };
@@ -233,11 +358,35 @@ namespace qasm
         qasm &ctx_;
         std::vector<int> indices_;
         friend class qasm;
+        friend class observable;
         friend qubits concat(const qubits &lhs, const qubits &rhs);
     };
 
     qubits concat(const qubits &lhs, const qubits &rhs);
 
+    /*-------------------------------------------------------
+     * パウリ文字列の重み付き和
+     *   paulis は 'I', 'X', 'Y', 'Z' からなり、qs と同じ長さ
+     *   e.g. obs.add(1.0, "ZZ", q[{0, 1}])
+     *------------------------------------------------------*/
+    struct pauli_term
+    {
+        double coeff;
+        std::vector<int> qubit_nums;
+        std::vector<char> paulis;
+    };
+
+    class observable
+    {
+    public:
+        observable &add(double coeff, const char *paulis, const qubits &qs);
+        observable &add(double coeff, const char *paulis, const indices_t &qs);
+        const std::vector<pauli_term> &terms() const { return terms_; }
+
+    private:
+        std::vector<pauli_term> terms_;
+    };
+
     /*-------------------------------------------------------
      * ビルダーに詰めるトークン
      *------------------------------------------------------*/
@@ -253,10 +402,10 @@ namespace qasm
             X,
             U4
         } kind;
-        double theta = 0;
-        double phi = 0;
-        double lambda = 0;
-        double gamma = 0;
+        angle theta = 0.0;
+        angle phi = 0.0;
+        angle lambda = 0.0;
+        angle gamma = 0.0;
         double val = 1;
         explicit token(kind_t k) : kind(k) {}
     };
@@ -267,8 +416,8 @@ namespace qasm
     class builder
     {
     public:
-        builder(const qasm &ctx);
-        builder(const qasm &ctx, token tk);
+        builder(qasm &ctx);
+        builder(qasm &ctx, token tk);
         builder(const builder &rhs);
         builder &operator=(const builder &rhs);
 
@@ -289,7 +438,7 @@ namespace qasm
         explicit builder(token tk) = delete;
 
     private:
-        const qasm &ctx_;
+        qasm &ctx_;
         std::vector<token> seq_;
 
         static void append_arg(std::vector<int> &out, int v);
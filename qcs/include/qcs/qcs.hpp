@@ -1,23 +1,85 @@
 #pragma once
 #include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cassert>
+#include <stdexcept>
 
 namespace qcs {
+    // control qubits as position/value masks: an amplitude index i is controlled iff (i & position) == value.
+    // qubit numbers >= 64 spill into the *_ext words, so the common case needs no heap allocation.
+    struct control_mask {
+        std::uint64_t position = 0;
+        std::uint64_t value = 0;
+        std::vector<std::uint64_t> position_ext;
+        std::vector<std::uint64_t> value_ext;
+
+        // a qubit controlled with both polarities can never fire; reject it rather than merging the two
+        void add(int qubit_num, bool ctrl_value) {
+            assert(qubit_num >= 0);
+            if (contains(qubit_num) && value_of(qubit_num) != ctrl_value) {
+                throw std::invalid_argument("qubit used as both ctrl and negctrl");
+            }
+            const std::size_t word = static_cast<std::size_t>(qubit_num) / 64;
+            const std::uint64_t bit = std::uint64_t(1) << (qubit_num % 64);
+            if (word == 0) {
+                position |= bit;
+                if (ctrl_value) { value |= bit; }
+                return;
+            }
+            if (position_ext.size() < word) {
+                position_ext.resize(word, 0);
+                value_ext.resize(word, 0);
+            }
+            position_ext[word - 1] |= bit;
+            if (ctrl_value) { value_ext[word - 1] |= bit; }
+        }
+        std::size_t num_words() const { return 1 + position_ext.size(); }
+        std::uint64_t position_word(std::size_t word) const { return word == 0 ? position : position_ext[word - 1]; }
+        std::uint64_t value_word(std::size_t word) const { return word == 0 ? value : value_ext[word - 1]; }
+        bool empty() const { return position == 0 && position_ext.empty(); }
+        bool contains(int qubit_num) const {
+            const std::size_t word = static_cast<std::size_t>(qubit_num) / 64;
+            return word < num_words() && (position_word(word) >> (qubit_num % 64) & 1);
+        }
+        bool value_of(int qubit_num) const {
+            const std::size_t word = static_cast<std::size_t>(qubit_num) / 64;
+            return word < num_words() && (value_word(word) >> (qubit_num % 64) & 1);
+        }
+    };
+
     struct simulator_core;
     class simulator {
     private:
         simulator_core* core;
         int num_qubits;
+        int batch_size;
         void ensure_qubits_allocated();
     public:
         simulator();
+        ~simulator();
+        simulator(const simulator&) = delete;
+        simulator& operator=(const simulator&) = delete;
         void setup();
         void dispose();
 
         int get_num_procs();
         int get_proc_num();
 
+        // per-instance log sink (default stderr, nullptr disables) and RNG seed, so instances can run on separate threads
+        void set_log_stream(std::FILE* stream);
+        void set_seed(std::uint64_t seed);
+        // worker threads for state initialization and kernels (default: hardware concurrency)
+        void set_num_threads(int num_threads);
+
         void promise_qubits(int num_qubits);
 
+        // dynamic qubit lifetime. Slots are always dense, 0 .. num_qubits-1, and are the bit positions used by control masks.
+        // attach_qubit(num_qubits) tensors |0> in as the new highest slot. detach_qubit(s) drops slot s, which must hold a
+        // basis state (after measure/reset), and halves the state; slots above s move down by one, as the shim renumbers them.
+        void attach_qubit(int qubit_num);
+        void detach_qubit(int qubit_num);
+
         void reset();
         void reset(int qubit_num);
         void set_zero_state();
@@ -33,5 +95,26 @@ namespace qcs {
         void gate_u4(double theta, double phi, double lambda, double gamma, int target_qubit_num, std::vector<int>&& negctrl_qubit_num_list, std::vector<int>&& ctrl_qubit_num_list);
         void gate_u4_pow(double theta, double phi, double lambda, double gamma, double exponent, int target_qubit_num, std::vector<int>&& negctrl_qubit_num_list, std::vector<int>&& ctrl_qubit_num_list);
         int measure(int qubit_num);
+
+        void hadamard(int target_qubit_num, const control_mask& ctrl_mask);
+        void hadamard_pow(double exponent, int target_qubit_num, const control_mask& ctrl_mask);
+        void gate_x(int target_qubit_num, const control_mask& ctrl_mask);
+        void gate_x_pow(double exponent, int target_qubit_num, const control_mask& ctrl_mask);
+        void gate_u4(double theta, double phi, double lambda, double gamma, int target_qubit_num, const control_mask& ctrl_mask);
+        void gate_u4_pow(double theta, double phi, double lambda, double gamma, double exponent, int target_qubit_num, const control_mask& ctrl_mask);
+
+        // trajectory support: take over another simulator's state; apply the amplitude-damping Kraus operator (decay or not) and renormalize
+        void copy_state(const simulator& source);
+        void amplitude_damping(double gamma, bool decay, int target_qubit_num);
+
+        // <Z...Z> over each parity list after rotating x/y basis qubits into the Z basis; the state is left unchanged
+        std::vector<double> expectation(std::vector<int>&& x_basis_qubit_num_list, std::vector<int>&& y_basis_qubit_num_list, std::vector<std::vector<int>>&& parity_qubit_num_lists);
+
+        // batched evaluation: K state vectors interleaved (amplitude i of batch k at i * K + k)
+        void set_batch_size(int batch_size);
+        int get_batch_size();
+        void gate_u4_batch(std::vector<double>&& theta_list, std::vector<double>&& phi_list, std::vector<double>&& lambda_list, std::vector<double>&& gamma_list, double exponent, int target_qubit_num, std::vector<int>&& negctrl_qubit_num_list, std::vector<int>&& ctrl_qubit_num_list);
+        void gate_u4_batch(std::vector<double>&& theta_list, std::vector<double>&& phi_list, std::vector<double>&& lambda_list, std::vector<double>&& gamma_list, double exponent, int target_qubit_num, const control_mask& ctrl_mask);
+        std::vector<int> measure_batch(int qubit_num);
     };
 }
@@ -1,89 +1,543 @@
 #include <qcs/qcs.hpp>
 #include <cstdio>
+#include <cstdarg>
+#include <cmath>
+#include <complex>
+#include <string>
+#include <thread>
+#include <new>
 #include <algorithm>
+#include <sys/mman.h>
+#include <unistd.h>
 
 namespace qcs {
 
-struct simulator_core {};
+typedef std::complex<double> amp_t;
 
-static void print_ctrls(const std::vector<int>& ncs, const std::vector<int>& pcs) {
-    fprintf(stderr, " negctrl=[");
+struct simulator_core {
+    std::FILE* log = stderr;
+    std::uint64_t seed = 0;
+    int num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    amp_t* state = nullptr;
+    std::size_t num_amps = 0;
+    std::size_t mapped_bytes = 0;
+    const char* page_kind = "";
+};
+
+// ログ 1 行を組み立て、破棄時に 1 回の fwrite で出力する。
+// 行単位で書き出すので、複数のシミュレータが同じストリームを共有しても行が混ざらない。
+class log_line {
+public:
+    explicit log_line(const simulator_core* core) : stream(core->log) {}
+    ~log_line() {
+        if (stream) {
+            buf += '\n';
+            fwrite(buf.data(), 1, buf.size(), stream);
+        }
+    }
+    void printf(const char* fmt, ...) __attribute__((format(printf, 2, 3))) {
+        if (!stream) { return; }
+        char tmp[256];
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+        va_end(ap);
+        if (n < 0) { return; }
+        if (static_cast<size_t>(n) < sizeof(tmp)) {
+            buf.append(tmp, n);
+            return;
+        }
+        std::string big(n + 1, '\0');
+        va_start(ap, fmt);
+        vsnprintf(&big[0], big.size(), fmt, ap);
+        va_end(ap);
+        buf.append(big.data(), n);
+    }
+private:
+    std::FILE* stream;
+    std::string buf;
+};
+
+/*-------------------------------------------------------
+ * 状態ベクトルの確保
+ *   1 GB → 2 MB の明示的ヒュージページを順に試し、
+ *   確保できなければ通常ページ + transparent huge page にする。
+ *   mmap はページに触れないので、物理ページの配置は
+ *   初期化時の first touch（parallel_blocks）で決まる。
+ *------------------------------------------------------*/
+static void* map_pages(std::size_t bytes, std::size_t page, int extra_flags) {
+    const std::size_t rounded = (bytes + page - 1) / page * page;
+    void* p = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | extra_flags, -1, 0);
+    return p == MAP_FAILED ? nullptr : p;
+}
+
+static void allocate_state(simulator_core* core, std::size_t num_amps) {
+    const std::size_t bytes = num_amps * sizeof(amp_t);
+    const std::size_t small_page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    void* p = nullptr;
+    std::size_t page = small_page;
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+    const std::size_t huge_1g = std::size_t(1) << 30;
+    const std::size_t huge_2m = std::size_t(2) << 20;
+    if (bytes >= huge_1g && (p = map_pages(bytes, huge_1g, MAP_HUGETLB | (30 << MAP_HUGE_SHIFT)))) {
+        page = huge_1g;
+        core->page_kind = "1GB";
+    } else if (bytes >= huge_2m && (p = map_pages(bytes, huge_2m, MAP_HUGETLB | (21 << MAP_HUGE_SHIFT)))) {
+        page = huge_2m;
+        core->page_kind = "2MB";
+    }
+#endif
+    if (p == nullptr) {
+        p = map_pages(bytes, small_page, 0);
+        if (p == nullptr) { throw std::bad_alloc(); }
+        page = small_page;
+        core->page_kind = "4KB";
+#ifdef MADV_HUGEPAGE
+        if (madvise(p, (bytes + page - 1) / page * page, MADV_HUGEPAGE) == 0) {
+            core->page_kind = "THP";
+        }
+#endif
+    }
+    core->state = static_cast<amp_t*>(p);
+    core->num_amps = num_amps;
+    core->mapped_bytes = (bytes + page - 1) / page * page;
+}
+
+static void free_state(simulator_core* core) {
+    if (core->state) {
+        munmap(core->state, core->mapped_bytes);
+    }
+    core->state = nullptr;
+    core->num_amps = 0;
+    core->mapped_bytes = 0;
+}
+
+// 分割単位: ヒュージページ 1 枚 (2 MiB) 分の振幅
+static const std::size_t block_amps = (std::size_t(2) << 20) / sizeof(amp_t);
+
+static std::size_t num_blocks(const simulator_core* core) {
+    return (core->num_amps + block_amps - 1) / block_amps;
+}
+
+// 状態ベクトルを走査する処理で共通のスレッド分割。
+// ブロック列を連続区間に切って呼び出しごとに新しいスレッドへ静的に割り当てる。
+// スレッドは CPU に固定しないので、first touch で各ページが置かれる NUMA ノードは
+// その時点で OS がスレッドを走らせた CPU 次第になる（ブロックを 1 スレッドが
+// まとめて触るため、ページ内でノードが混ざることはない）。
+template <class F>
+static void parallel_blocks(const simulator_core* core, F f) {
+    const std::size_t nb = num_blocks(core);
+    const std::size_t nt = std::min<std::size_t>(core->num_threads, nb);
+    auto run = [&](std::size_t t) {
+        for (std::size_t b = nb * t / nt; b < nb * (t + 1) / nt; ++b) {
+            f(b * block_amps, std::min(core->num_amps, (b + 1) * block_amps), b);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (std::size_t t = 1; t < nt; ++t) {
+        threads.emplace_back(run, t);
+    }
+    if (nt > 0) { run(0); }
+    for (auto& th : threads) { th.join(); }
+}
+
+// 状態を num_amps 振幅の新しいバッファへ移す。
+// fill(to, from, begin, end) が新バッファの [begin, end) を旧バッファ from から埋める。
+template <class F>
+static void replace_state(simulator_core* core, std::size_t num_amps, F fill) {
+    const amp_t* from = core->state;
+    const std::size_t old_amps = core->num_amps;
+    const std::size_t old_bytes = core->mapped_bytes;
+    const char* old_kind = core->page_kind;
+    try {
+        allocate_state(core, num_amps);
+    } catch (...) {
+        core->state = const_cast<amp_t*>(from);
+        core->num_amps = old_amps;
+        core->mapped_bytes = old_bytes;
+        core->page_kind = old_kind;
+        throw;
+    }
+    amp_t* to = core->state;
+    parallel_blocks(core, [=](std::size_t begin, std::size_t end, std::size_t) { fill(to, from, begin, end); });
+    munmap(const_cast<amp_t*>(from), old_bytes);
+}
+
+// counter-based RNG (SplitMix64): 値は (seed, counter) だけで決まり、スレッド分割に依存しない
+static std::uint64_t splitmix64(std::uint64_t seed, std::uint64_t counter) {
+    std::uint64_t z = seed + (counter + 1) * 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static double uniform01(std::uint64_t seed, std::uint64_t counter) {
+    return static_cast<double>(splitmix64(seed, counter) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void print_ctrls(log_line& log, const std::vector<int>& ncs, const std::vector<int>& pcs) {
+    log.printf(" negctrl=[");
     for (size_t i = 0; i < ncs.size(); ++i) {
-        fprintf(stderr, "%s%d", i ? "," : "", ncs[i]);
+        log.printf("%s%d", i ? "," : "", ncs[i]);
     }
-    fprintf(stderr, "] ctrl=[");
+    log.printf("] ctrl=[");
     for (size_t i = 0; i < pcs.size(); ++i) {
-        fprintf(stderr, "%s%d", i ? "," : "", pcs[i]);
+        log.printf("%s%d", i ? "," : "", pcs[i]);
+    }
+    log.printf("]");
+}
+
+static control_mask to_mask(const std::vector<int>& ncs, const std::vector<int>& pcs) {
+    control_mask mask;
+    for (int q : ncs) { mask.add(q, false); }
+    for (int q : pcs) { mask.add(q, true); }
+    return mask;
+}
+
+static void print_ctrls(log_line& log, const control_mask& mask) {
+    std::vector<int> ncs, pcs;
+    for (std::size_t w = 0; w < mask.num_words(); ++w) {
+        for (int b = 0; b < 64; ++b) {
+            const std::uint64_t bit = std::uint64_t(1) << b;
+            if (mask.position_word(w) & bit) {
+                ((mask.value_word(w) & bit) ? pcs : ncs).push_back(static_cast<int>(w * 64 + b));
+            }
+        }
+    }
+    print_ctrls(log, ncs, pcs);
+}
+
+static void print_list(log_line& log, const char* name, const std::vector<double>& xs) {
+    log.printf(" %s=[", name);
+    for (size_t i = 0; i < xs.size(); ++i) {
+        log.printf("%s%lf", i ? "," : "", xs[i]);
     }
-    fprintf(stderr, "]");
+    log.printf("]");
+}
+
+simulator::simulator() : core(new simulator_core), num_qubits(0), batch_size(1) {}
+
+simulator::~simulator() {
+    free_state(core);
+    delete core;
 }
 
-simulator::simulator() : core(nullptr), num_qubits(0) {}
+void simulator::set_log_stream(std::FILE* stream) { core->log = stream; }
+
+void simulator::set_seed(std::uint64_t seed) { core->seed = seed; }
+
+void simulator::set_num_threads(int n) { core->num_threads = std::max(1, n); }
 
 void simulator::setup() {}
 
-void simulator::dispose() {}
+void simulator::dispose() { free_state(core); }
 
 int simulator::get_num_procs() { return 1; }
 
 int simulator::get_proc_num() { return 0; }
 
 void simulator::promise_qubits(int n) {
+    log_line log(core);
     num_qubits = std::max(num_qubits, n);
-    fprintf(stderr, "[promise_qubits] %d\n", n);
+    log.printf("[promise_qubits] %d", n);
 }
 
-void simulator::ensure_qubits_allocated() {}
+void simulator::attach_qubit(int qubit_num) {
+    log_line log(core);
+    assert(qubit_num == num_qubits);
+    ++num_qubits;
+    if (core->state) {
+        // 新しいスロットは最上位ビットなので、旧振幅は下半分にそのまま残り上半分は 0
+        const std::size_t old_amps = core->num_amps;
+        replace_state(core, old_amps * 2, [=](amp_t* to, const amp_t* from, std::size_t begin, std::size_t end) {
+            for (std::size_t j = begin; j < end; ++j) {
+                to[j] = j < old_amps ? from[j] : amp_t(0.0);
+            }
+        });
+    }
+    log.printf("[attach_qubit] %d", qubit_num);
+}
+
+void simulator::detach_qubit(int qubit_num) {
+    log_line log(core);
+    assert(0 <= qubit_num && qubit_num < num_qubits);
+    if (core->state) {
+        // 切り離すスロットは基底状態にある。バッチ要素ごとにノルムの大きい側の値を残し、
+        // 上のスロットを 1 つずつ詰める
+        const std::size_t K = static_cast<std::size_t>(batch_size);
+        const std::size_t bit = std::size_t(1) << qubit_num;
+        const std::size_t low = bit - 1;
+        std::vector<double> norm0(K, 0.0), norm1(K, 0.0);
+        for (std::size_t j = 0; j < core->num_amps; ++j) {
+            (((j / K) & bit) ? norm1 : norm0)[j % K] += std::norm(core->state[j]);
+        }
+        std::vector<std::size_t> value(K);
+        for (std::size_t k = 0; k < K; ++k) { value[k] = norm1[k] > norm0[k] ? bit : 0; }
+        replace_state(core, core->num_amps / 2, [&](amp_t* to, const amp_t* from, std::size_t begin, std::size_t end) {
+            for (std::size_t j = begin; j < end; ++j) {
+                const std::size_t i = j / K, k = j % K;
+                to[j] = from[((i & low) | ((i & ~low) << 1) | value[k]) * K + k];
+            }
+        });
+    }
+    --num_qubits;
+    log.printf("[detach_qubit] %d", qubit_num);
+}
+
+void simulator::ensure_qubits_allocated() {
+    // バッチ要素は振幅ごとにインターリーブ: 基底 i, バッチ k → i * batch_size + k
+    const std::size_t num_amps = (std::size_t(1) << num_qubits) * batch_size;
+    if (core->state && core->num_amps == num_amps) { return; }
+    free_state(core);
+    allocate_state(core, num_amps);
+    log_line log(core);
+    log.printf("[allocate_state] qubits=%d K=%d bytes=%zu pages=%s threads=%d", num_qubits, batch_size, core->mapped_bytes, core->page_kind, core->num_threads);
+}
 
 void simulator::reset() {}
 
 void simulator::reset(int qubit_num) {
-    fprintf(stderr, "[reset] %d\n", qubit_num);
+    log_line log(core);
+    log.printf("[reset] %d", qubit_num);
 }
 
-void simulator::set_zero_state() {}
+void simulator::set_zero_state() {
+    ensure_qubits_allocated();
+    const std::size_t k_count = batch_size;
+    amp_t* state = core->state;
+    parallel_blocks(core, [=](std::size_t begin, std::size_t end, std::size_t) {
+        for (std::size_t j = begin; j < end; ++j) {
+            state[j] = j < k_count ? amp_t(1.0) : amp_t(0.0);
+        }
+    });
+    log_line log(core);
+    log.printf("[set_zero_state]");
+}
 
-void simulator::set_sequential_state() {}
+void simulator::set_sequential_state() {
+    ensure_qubits_allocated();
+    // 振幅 ∝ 基底番号 i,  Σ i^2 = (N-1) N (2N-1) / 6
+    const std::size_t k_count = batch_size;
+    const double n = std::ldexp(1.0, num_qubits);
+    const double norm = 1.0 / std::sqrt((n - 1) * n * (2 * n - 1) / 6);
+    amp_t* state = core->state;
+    parallel_blocks(core, [=](std::size_t begin, std::size_t end, std::size_t) {
+        for (std::size_t j = begin; j < end; ++j) {
+            state[j] = amp_t(static_cast<double>(j / k_count) * norm);
+        }
+    });
+    if (num_qubits == 0) {
+        // 振幅が 1 つだけだと Σ i^2 = 0 になるので |0> とする
+        std::fill(state, state + k_count, amp_t(1.0));
+    }
+    log_line log(core);
+    log.printf("[set_sequential_state]");
+}
 
-void simulator::set_flat_state() {}
+void simulator::set_flat_state() {
+    ensure_qubits_allocated();
+    const amp_t v(std::sqrt(std::ldexp(1.0, -num_qubits)));
+    amp_t* state = core->state;
+    parallel_blocks(core, [=](std::size_t begin, std::size_t end, std::size_t) {
+        std::fill(state + begin, state + end, v);
+    });
+    log_line log(core);
+    log.printf("[set_flat_state]");
+}
 
-void simulator::set_entangled_state() {}
+void simulator::set_entangled_state() {
+    ensure_qubits_allocated();
+    // (|0...0> + |1...1>) / sqrt(2)
+    const std::size_t k_count = batch_size;
+    const std::size_t last = core->num_amps - k_count;
+    const amp_t v(std::sqrt(0.5));
+    amp_t* state = core->state;
+    parallel_blocks(core, [=](std::size_t begin, std::size_t end, std::size_t) {
+        for (std::size_t j = begin; j < end; ++j) {
+            state[j] = (j < k_count || j >= last) ? v : amp_t(0.0);
+        }
+    });
+    if (num_qubits == 0) {
+        std::fill(state, state + k_count, amp_t(1.0));
+    }
+    log_line log(core);
+    log.printf("[set_entangled_state]");
+}
 
-void simulator::set_random_state() {}
+void simulator::set_random_state() {
+    ensure_qubits_allocated();
+    // 振幅 j の実部・虚部は (seed, 2j), (seed, 2j+1) から Box-Muller で生成するので、
+    // スレッド数によらず同じ seed なら同じ状態になる。ノルムもブロックごとの部分和を
+    // ブロック順に足すので再現性がある。
+    const std::size_t k_count = batch_size;
+    const std::uint64_t seed = core->seed;
+    amp_t* state = core->state;
+    std::vector<double> partial(num_blocks(core) * k_count, 0.0);
+    double* partial_ptr = partial.data();
+    parallel_blocks(core, [=](std::size_t begin, std::size_t end, std::size_t block) {
+        double* sums = partial_ptr + block * k_count;
+        for (std::size_t j = begin; j < end; ++j) {
+            const double u1 = 1.0 - uniform01(seed, 2 * j);
+            const double u2 = uniform01(seed, 2 * j + 1);
+            const double r = std::sqrt(-2.0 * std::log(u1));
+            state[j] = std::polar(r, 2.0 * M_PI * u2);
+            sums[j % k_count] += r * r;
+        }
+    });
+    std::vector<double> inv_norm(k_count, 0.0);
+    for (std::size_t i = 0; i < partial.size(); ++i) {
+        inv_norm[i % k_count] += partial[i];
+    }
+    for (double& v : inv_norm) {
+        v = 1.0 / std::sqrt(v);
+    }
+    const double* inv_norm_ptr = inv_norm.data();
+    parallel_blocks(core, [=](std::size_t begin, std::size_t end, std::size_t) {
+        for (std::size_t j = begin; j < end; ++j) {
+            state[j] *= inv_norm_ptr[j % k_count];
+        }
+    });
+    log_line log(core);
+    log.printf("[set_random_state] seed=%llu", static_cast<unsigned long long>(seed));
+}
 
 void simulator::hadamard(int target, std::vector<int>&& ncs, std::vector<int>&& pcs) {
-    hadamard_pow(1.0, target, std::move(ncs), std::move(pcs));
+    hadamard_pow(1.0, target, to_mask(ncs, pcs));
 }
 
 void simulator::hadamard_pow(double exponent, int target, std::vector<int>&& ncs, std::vector<int>&& pcs) {
-    fprintf(stderr, "[hadamard_pow] exp=%lf tgt=%d", exponent, target);
-    print_ctrls(ncs, pcs);
-    fprintf(stderr, "\n");
+    hadamard_pow(exponent, target, to_mask(ncs, pcs));
 }
 
 void simulator::gate_x(int target, std::vector<int>&& ncs, std::vector<int>&& pcs) {
-    gate_x_pow(1.0, target, std::move(ncs), std::move(pcs));
+    gate_x_pow(1.0, target, to_mask(ncs, pcs));
 }
 
 void simulator::gate_x_pow(double exponent, int target, std::vector<int>&& ncs, std::vector<int>&& pcs) {
-    fprintf(stderr, "[gate_x_pow] exp=%lf tgt=%d", exponent, target);
-    print_ctrls(ncs, pcs);
-    fprintf(stderr, "\n");
+    gate_x_pow(exponent, target, to_mask(ncs, pcs));
 }
 
 void simulator::gate_u4(double th, double ph, double la, double ga, int target, std::vector<int>&& ncs, std::vector<int>&& pcs) {
-    gate_u4_pow(th, ph, la, ga, 1.0, target, std::move(ncs), std::move(pcs));
+    gate_u4_pow(th, ph, la, ga, 1.0, target, to_mask(ncs, pcs));
 }
 
 void simulator::gate_u4_pow(double th, double ph, double la, double ga, double exp, int target, std::vector<int>&& ncs, std::vector<int>&& pcs) {
-    fprintf(stderr, "[gate_u4_pow] th=%lf ph=%lf la=%lf ga=%lf exp=%lf tgt=%d", th, ph, la, ga, exp, target);
-    print_ctrls(ncs, pcs);
-    fprintf(stderr, "\n");
+    gate_u4_pow(th, ph, la, ga, exp, target, to_mask(ncs, pcs));
+}
+
+void simulator::hadamard(int target, const control_mask& mask) {
+    hadamard_pow(1.0, target, mask);
+}
+
+void simulator::hadamard_pow(double exponent, int target, const control_mask& mask) {
+    log_line log(core);
+    log.printf("[hadamard_pow] exp=%lf tgt=%d", exponent, target);
+    print_ctrls(log, mask);
+}
+
+void simulator::gate_x(int target, const control_mask& mask) {
+    gate_x_pow(1.0, target, mask);
+}
+
+void simulator::gate_x_pow(double exponent, int target, const control_mask& mask) {
+    log_line log(core);
+    log.printf("[gate_x_pow] exp=%lf tgt=%d", exponent, target);
+    print_ctrls(log, mask);
+}
+
+void simulator::gate_u4(double th, double ph, double la, double ga, int target, const control_mask& mask) {
+    gate_u4_pow(th, ph, la, ga, 1.0, target, mask);
+}
+
+void simulator::gate_u4_pow(double th, double ph, double la, double ga, double exp, int target, const control_mask& mask) {
+    log_line log(core);
+    log.printf("[gate_u4_pow] th=%lf ph=%lf la=%lf ga=%lf exp=%lf tgt=%d", th, ph, la, ga, exp, target);
+    print_ctrls(log, mask);
 }
 
 int simulator::measure(int qubit_num) {
-    fprintf(stderr, "[measure] %d\n", qubit_num);
+    log_line log(core);
+    log.printf("[measure] %d", qubit_num);
     return 0;
 }
 
+void simulator::copy_state(const simulator& source) {
+    num_qubits = source.num_qubits;
+    batch_size = source.batch_size;
+    if (source.core->state) {
+        // コピー量はコピー元バッファの実際の大きさで決める
+        assert(source.core->num_amps == (std::size_t(1) << num_qubits) * batch_size);
+        if (core->num_amps != source.core->num_amps) {
+            free_state(core);
+            allocate_state(core, source.core->num_amps);
+        }
+        const amp_t* from = source.core->state;
+        amp_t* to = core->state;
+        parallel_blocks(core, [=](std::size_t begin, std::size_t end, std::size_t) {
+            std::copy(from + begin, from + end, to + begin);
+        });
+    } else {
+        free_state(core);
+    }
+    log_line log(core);
+    log.printf("[copy_state] qubits=%d K=%d", num_qubits, batch_size);
+}
+
+void simulator::amplitude_damping(double gamma, bool decay, int target) {
+    log_line log(core);
+    log.printf("[amplitude_damping] gamma=%lf decay=%d tgt=%d", gamma, decay ? 1 : 0, target);
+}
+
+std::vector<double> simulator::expectation(std::vector<int>&& xs, std::vector<int>&& ys, std::vector<std::vector<int>>&& parities) {
+    log_line log(core);
+    log.printf("[expectation] x=[");
+    for (size_t i = 0; i < xs.size(); ++i) {
+        log.printf("%s%d", i ? "," : "", xs[i]);
+    }
+    log.printf("] y=[");
+    for (size_t i = 0; i < ys.size(); ++i) {
+        log.printf("%s%d", i ? "," : "", ys[i]);
+    }
+    log.printf("] parity=[");
+    for (size_t i = 0; i < parities.size(); ++i) {
+        log.printf("%s[", i ? "," : "");
+        for (size_t j = 0; j < parities[i].size(); ++j) {
+            log.printf("%s%d", j ? "," : "", parities[i][j]);
+        }
+        log.printf("]");
+    }
+    log.printf("]");
+    return std::vector<double>(parities.size(), 0.0);
+}
+
+void simulator::set_batch_size(int n) {
+    log_line log(core);
+    batch_size = n;
+    log.printf("[set_batch_size] %d", n);
+}
+
+int simulator::get_batch_size() { return batch_size; }
+
+void simulator::gate_u4_batch(std::vector<double>&& th, std::vector<double>&& ph, std::vector<double>&& la, std::vector<double>&& ga, double exp, int target, std::vector<int>&& ncs, std::vector<int>&& pcs) {
+    gate_u4_batch(std::move(th), std::move(ph), std::move(la), std::move(ga), exp, target, to_mask(ncs, pcs));
+}
+
+void simulator::gate_u4_batch(std::vector<double>&& th, std::vector<double>&& ph, std::vector<double>&& la, std::vector<double>&& ga, double exp, int target, const control_mask& mask) {
+    log_line log(core);
+    log.printf("[gate_u4_batch] K=%d", batch_size);
+    print_list(log, "th", th);
+    print_list(log, "ph", ph);
+    print_list(log, "la", la);
+    print_list(log, "ga", ga);
+    log.printf(" exp=%lf tgt=%d", exp, target);
+    print_ctrls(log, mask);
+}
+
+std::vector<int> simulator::measure_batch(int qubit_num) {
+    log_line log(core);
+    log.printf("[measure_batch] K=%d %d", batch_size, qubit_num);
+    return std::vector<int>(batch_size, 0);
+}
+
 } // namespace qcs
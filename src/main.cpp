@@ -1,28 +1,175 @@
 #include <cstdio>
+#include <cstdlib>
 #include <dlfcn.h>
 #include <stdexcept>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <memory>
 #include <qasm/qasm.hpp>
 #include <qcs/qcs.hpp>
 
-int main()
+namespace {
+
+typedef qasm::qasm *(*constructor_t)();
+
+struct instance_result
+{
+    // one row per circuit evaluation (K rows for a run_batch instance)
+    std::vector<std::vector<int>> outcomes;
+    // outcome counts of a trajectory run
+    std::map<std::vector<int>, int> counts;
+    std::string log;
+    std::exception_ptr error;
+};
+
+// 1 インスタンス分: 専用のシミュレータ・ログ・乱数シードで circuit() を実行する
+void run_instance(constructor_t userqasm_constructor, int instance_num, int sim_threads, int num_trajectories, bool capture_log, instance_result &out)
+{
+    char *log_buf = nullptr;
+    std::size_t log_size = 0;
+    std::FILE *log = capture_log ? open_memstream(&log_buf, &log_size) : stderr;
+    if (log == NULL) {
+        out.error = std::make_exception_ptr(std::runtime_error("open_memstream failed"));
+        return;
+    }
+
+    try {
+        qcs::simulator sim;
+        sim.set_log_stream(log);
+        sim.set_seed(static_cast<std::uint64_t>(instance_num));
+        sim.set_num_threads(sim_threads);
+        sim.setup();
+
+        // circuit() が例外を投げても q を破棄し、dispose まで到達させる
+        try {
+            std::unique_ptr<qasm::qasm> q(userqasm_constructor());
+            q->register_simulator(&sim);
+            const auto bindings = q->bindings();
+            if (num_trajectories > 0) {
+                out.counts = q->run_trajectories(q->noise(), num_trajectories, sim_threads, static_cast<std::uint64_t>(instance_num));
+            } else if (bindings.empty()) {
+                q->circuit();
+                out.outcomes.push_back(q->measurements());
+            } else {
+                out.outcomes = q->run_batch(bindings);
+            }
+        } catch (...) {
+            out.error = std::current_exception();
+        }
+
+        sim.dispose();
+    } catch (...) {
+        if (!out.error) { out.error = std::current_exception(); }
+    }
+
+    if (capture_log) {
+        fclose(log);
+        out.log.assign(log_buf, log_size);
+        free(log_buf);
+    }
+}
+
+int parse_count(const char *arg)
+{
+    char *end = nullptr;
+    long v = std::strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || v <= 0) { throw std::invalid_argument(std::string("invalid count: ") + arg); }
+    return static_cast<int>(v);
+}
+
+} // namespace
+
+// usage: main [num_instances [num_threads [num_trajectories]]]
+int main(int argc, char **argv)
 {
-    qcs::simulator sim;
-    sim.setup();
+    const int num_instances = argc > 1 ? parse_count(argv[1]) : 1;
+    const int num_trajectories = argc > 3 ? parse_count(argv[3]) : 0;
+    int num_threads = argc > 2 ? parse_count(argv[2]) : static_cast<int>(std::thread::hardware_concurrency());
+    if (num_threads <= 0) { num_threads = 1; }
+    if (num_threads > num_instances) { num_threads = num_instances; }
 
     const auto userqasm_dl = dlopen("./userqasm.so", RTLD_LAZY);
     if (userqasm_dl == NULL) { throw std::runtime_error("dlopen failed"); }
 
-    auto userqasm_constructor = reinterpret_cast<qasm::qasm*(*)()>(dlsym(userqasm_dl, "constructor"));
+    auto userqasm_constructor = reinterpret_cast<constructor_t>(dlsym(userqasm_dl, "constructor"));
 
-    qasm::qasm* q = userqasm_constructor();
-    q->register_simulator(&sim);
-    q->circuit();
-    delete q;
+    // 単一インスタンスのときはログを直接 stderr に流す
+    const bool capture_log = num_instances > 1;
+    // コアをインスタンス間で分け合い、シミュレータ内部のスレッドで過剰に並列化しない
+    const int sim_threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()) / num_threads);
+    std::vector<instance_result> results(num_instances);
+    std::atomic<int> next_instance(0);
+    auto worker = [&]() {
+        for (int i = next_instance++; i < num_instances; i = next_instance++) {
+            run_instance(userqasm_constructor, i, sim_threads, num_trajectories, capture_log, results[i]);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 1; t < num_threads; ++t) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &th : threads) {
+        th.join();
+    }
 
-    sim.dispose();
+    // 失敗したインスタンスはその場で報告し、残りのインスタンスの集計は続ける
+    std::map<std::vector<int>, int> histogram;
+    int num_failed = 0;
+    for (int i = 0; i < num_instances; ++i) {
+        const instance_result &r = results[i];
+        fwrite(r.log.data(), 1, r.log.size(), stderr);
+        if (r.error) {
+            ++num_failed;
+            try {
+                std::rethrow_exception(r.error);
+            } catch (const std::exception &e) {
+                fprintf(stderr, "instance %d: error: %s\n", i, e.what());
+            } catch (...) {
+                fprintf(stderr, "instance %d: error: unknown exception\n", i);
+            }
+            continue;
+        }
+        for (std::size_t k = 0; k < r.outcomes.size(); ++k) {
+            if (r.outcomes.size() > 1) {
+                fprintf(stderr, "instance %d batch %zu:", i, k);
+            } else {
+                fprintf(stderr, "instance %d:", i);
+            }
+            for (int v : r.outcomes[k]) {
+                fprintf(stderr, " %d", v);
+            }
+            fprintf(stderr, "\n");
+            ++histogram[r.outcomes[k]];
+        }
+        for (const auto &c : r.counts) {
+            fprintf(stderr, "instance %d:", i);
+            for (int v : c.first) {
+                fprintf(stderr, " %d", v);
+            }
+            fprintf(stderr, " x%d\n", c.second);
+            histogram[c.first] += c.second;
+        }
+    }
+    if (num_instances > 1) {
+        for (const auto &h : histogram) {
+            for (int v : h.first) {
+                fprintf(stderr, "%d", v);
+            }
+            fprintf(stderr, ": %d\n", h.second);
+        }
+        if (num_failed > 0) {
+            fprintf(stderr, "%d of %d instances failed\n", num_failed, num_instances);
+        }
+    }
 
     int const ret_dlclose = dlclose(userqasm_dl);
     if (ret_dlclose != 0) { throw std::runtime_error("dlclose failed"); }
 
-    return 0;
-}
\ No newline at end of file
+    return num_failed > 0 ? 1 : 0;
+}
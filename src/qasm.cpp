@@ -2,6 +2,16 @@
 #include <qcs/qcs.hpp>
 #include <utility>
 #include <stdexcept>
+#include <cstring>
+#include <map>
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <exception>
 
 namespace qasm {
 
@@ -17,14 +27,271 @@ slice_t slice(int first, int step, int last) {
 
 set::set(std::initializer_list<int> lst) : indices(lst) {}
 
+double angle::value(const std::vector<double> &binding) const {
+    if (param_id < 0) {
+        return offset;
+    }
+    assert(param_id < static_cast<int>(binding.size()));
+    return scale * binding[param_id] + offset;
+}
+
+angle operator*(double k, const angle &a) {
+    angle out = a;
+    out.scale *= k;
+    out.offset *= k;
+    return out;
+}
+
+angle operator*(const angle &a, double k) {
+    return k * a;
+}
+
+angle operator+(const angle &a, double c) {
+    angle out = a;
+    out.offset += c;
+    return out;
+}
+
+angle operator+(double c, const angle &a) {
+    return a + c;
+}
+
+angle operator-(const angle &a, double c) {
+    return a + (-c);
+}
+
+angle operator-(double c, const angle &a) {
+    return -a + c;
+}
+
+angle operator-(const angle &a) {
+    return -1.0 * a;
+}
+
+/*-------------------------------------------------------
+ * 記録される 1 命令（制御付きゲート / reset / measure）
+ *------------------------------------------------------*/
+struct instruction {
+    enum kind_t {
+        HADAMARD,
+        X,
+        U4,
+        RESET,
+        MEASURE,
+        ATTACH,
+        DETACH
+    } kind;
+    int target;
+    double exponent = 1.0;
+    angle theta = 0.0;
+    angle phi = 0.0;
+    angle lambda = 0.0;
+    angle gamma = 0.0;
+    qcs::control_mask ctrls;
+    instruction(kind_t k, int tgt) : kind(k), target(tgt) {}
+    bool is_symbolic() const {
+        return theta.is_symbolic() || phi.is_symbolic() || lambda.is_symbolic() || gamma.is_symbolic();
+    }
+};
+
+struct program {
+    std::vector<instruction> code;
+};
+
+namespace {
+
+double bound(const angle &a, const std::vector<double> *binding) {
+    if (!a.is_symbolic()) {
+        return a.offset;
+    }
+    if (binding == nullptr) {
+        throw std::runtime_error("unbound parameter outside run_batch");
+    }
+    return a.value(*binding);
+}
+
+// 1 命令をシミュレータへ発行する。MEASURE の場合は測定値を返す。
+int dispatch(qcs::simulator &sim, const instruction &in, const std::vector<double> *binding) {
+    switch (in.kind) {
+    case instruction::X:
+        if (in.exponent == 1.0) {
+            sim.gate_x(in.target, in.ctrls);
+        } else {
+            sim.gate_x_pow(in.exponent, in.target, in.ctrls);
+        }
+        break;
+    case instruction::HADAMARD:
+        if (in.exponent == 1.0) {
+            sim.hadamard(in.target, in.ctrls);
+        } else {
+            sim.hadamard_pow(in.exponent, in.target, in.ctrls);
+        }
+        break;
+    case instruction::U4: {
+        double th = bound(in.theta, binding);
+        double ph = bound(in.phi, binding);
+        double la = bound(in.lambda, binding);
+        double ga = bound(in.gamma, binding);
+        if (in.exponent == 1.0) {
+            sim.gate_u4(th, ph, la, ga, in.target, in.ctrls);
+        } else {
+            sim.gate_u4_pow(th, ph, la, ga, in.exponent, in.target, in.ctrls);
+        }
+        break;
+    }
+    case instruction::RESET:
+        sim.reset(in.target);
+        break;
+    case instruction::MEASURE:
+        return sim.measure(in.target);
+    case instruction::ATTACH:
+        sim.attach_qubit(in.target);
+        break;
+    case instruction::DETACH:
+        sim.detach_qubit(in.target);
+        break;
+    }
+    return 0;
+}
+
+// 例外で抜けてもシミュレータをバッチサイズ 1 に戻す
+struct batch_scope {
+    qcs::simulator &sim;
+    batch_scope(qcs::simulator &s, int batch_size) : sim(s) {
+        sim.set_batch_size(batch_size);
+    }
+    ~batch_scope() {
+        sim.set_batch_size(1);
+    }
+};
+
+/*-------------------------------------------------------
+ * 量子軌跡法
+ *   記録した命令列の各ゲートの後ろにノイズチャネルを挿入した
+ *   ステップ列を作り、ステップ番号を乱数のカウンタに使う。
+ *------------------------------------------------------*/
+struct step {
+    enum kind_t {
+        INSTRUCTION,
+        DEPOLARIZING,
+        AMPLITUDE_DAMPING
+    } kind;
+    const instruction *in;
+    int qubit;
+    double p;
+};
+
+std::vector<step> schedule(const std::vector<instruction> &code, const noise_model &noise) {
+    std::vector<step> steps;
+    for (const auto &in : code) {
+        steps.push_back(step{step::INSTRUCTION, &in, in.target, 0.0});
+        const channel *ch = in.kind == instruction::HADAMARD ? &noise.hadamard
+                            : in.kind == instruction::X      ? &noise.x
+                            : in.kind == instruction::U4     ? &noise.u4
+                                                             : nullptr;
+        if (ch == nullptr) {
+            continue;
+        }
+        std::vector<int> touched(1, in.target);
+        for (std::size_t w = 0; w < in.ctrls.num_words(); ++w) {
+            for (int b = 0; b < 64; ++b) {
+                if (in.ctrls.position_word(w) & (std::uint64_t(1) << b)) {
+                    touched.push_back(static_cast<int>(w * 64 + b));
+                }
+            }
+        }
+        for (int q : touched) {
+            if (ch->depolarizing > 0.0) {
+                steps.push_back(step{step::DEPOLARIZING, nullptr, q, ch->depolarizing});
+            }
+            if (ch->amplitude_damping > 0.0) {
+                steps.push_back(step{step::AMPLITUDE_DAMPING, nullptr, q, ch->amplitude_damping});
+            }
+        }
+    }
+    return steps;
+}
+
+// counter-based RNG: (seed, trajectory, step, stream) から一様乱数を決める
+double sample(std::uint64_t seed, std::uint64_t trajectory, std::uint64_t step_num, std::uint64_t stream) {
+    std::uint64_t z = seed;
+    const std::uint64_t words[3] = {trajectory, step_num, stream};
+    for (std::uint64_t w : words) {
+        z += (w + 1) * 0x9E3779B97F4A7C15ull;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        z ^= z >> 31;
+    }
+    return static_cast<double>(z >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// 軌跡 t のステップ p で起きる Pauli 誤り (0: なし, 1: X, 2: Y, 3: Z)
+int pauli_error(const step &st, std::uint64_t seed, int t, std::size_t p) {
+    if (sample(seed, t, p, 0) >= st.p) {
+        return 0;
+    }
+    return 1 + static_cast<int>(sample(seed, t, p, 1) * 3.0) % 3;
+}
+
+void apply_pauli(qcs::simulator &sim, int pauli, int qubit) {
+    const qcs::control_mask none;
+    switch (pauli) {
+    case 1:
+        sim.gate_x(qubit, none);
+        break;
+    case 2:
+        sim.gate_u4(M_PI, M_PI / 2, M_PI / 2, 0, qubit, none);
+        break;
+    case 3:
+        sim.gate_u4(0, 0, M_PI, 0, qubit, none);
+        break;
+    }
+}
+
+double decay_probability(qcs::simulator &sim, const step &st) {
+    std::vector<std::vector<int>> parity(1, std::vector<int>(1, st.qubit));
+    const double z = sim.expectation(std::vector<int>(), std::vector<int>(), std::move(parity))[0];
+    return st.p * (1.0 - z) / 2.0;
+}
+
+// 分岐した軌跡 t をステップ p から最後まで進め、測定結果を record に追記する
+void run_steps(qcs::simulator &sim, const std::vector<step> &steps, const noise_model &noise,
+               std::uint64_t seed, int t, std::size_t p, std::vector<int> &record) {
+    for (; p < steps.size(); ++p) {
+        const step &st = steps[p];
+        switch (st.kind) {
+        case step::INSTRUCTION:
+            if (st.in->kind == instruction::MEASURE) {
+                int r = dispatch(sim, *st.in, nullptr);
+                if (sample(seed, t, p, 2) < (r ? noise.readout_p10 : noise.readout_p01)) {
+                    r ^= 1;
+                }
+                record.push_back(r);
+            } else {
+                dispatch(sim, *st.in, nullptr);
+            }
+            break;
+        case step::DEPOLARIZING:
+            apply_pauli(sim, pauli_error(st, seed, t, p), st.qubit);
+            break;
+        case step::AMPLITUDE_DAMPING:
+            sim.amplitude_damping(st.p, sample(seed, t, p, 0) < decay_probability(sim, st), st.qubit);
+            break;
+        }
+    }
+}
+
+} // namespace
+
 qubits::qubits(qasm &ctx, int n) : ctx_(ctx) {
     assert(n > 0);
-    assert(ctx.simulator_ && "simulator not registered");
     indices_.reserve(n);
     for (int i = 0; i < n; ++i) {
         indices_.push_back(ctx.next_id_++);
     }
-    ctx.simulator_->promise_qubits(n);
+    // 物理スロットは最初に触れたときに割り当てる（qasm::slot）
+    ctx.slot_of_.resize(ctx.next_id_, qasm::unmapped);
+    ctx.in_basis_.resize(ctx.next_id_, 1);
 }
 
 qubits::qubits(qasm &ctx, std::vector<int> idx) : ctx_(ctx), indices_(std::move(idx)) {}
@@ -84,9 +351,34 @@ qubits concat(const qubits &lhs, const qubits &rhs) {
     return qubits(lhs.ctx_, std::move(idx));
 }
 
-builder::builder(const qasm &ctx) : ctx_(ctx) {}
+observable &observable::add(double coeff, const char *paulis, const qubits &qs) {
+    indices_t idx;
+    idx.values = qs.indices_;
+    return add(coeff, paulis, idx);
+}
+
+observable &observable::add(double coeff, const char *paulis, const indices_t &qs) {
+    pauli_term term;
+    term.coeff = coeff;
+    for (std::size_t i = 0; paulis[i] != '\0'; ++i) {
+        char p = paulis[i];
+        assert(p == 'I' || p == 'X' || p == 'Y' || p == 'Z');
+        assert(i < qs.values.size());
+        if (p != 'I') {
+            assert(std::find(term.qubit_nums.begin(), term.qubit_nums.end(), qs.values[i]) == term.qubit_nums.end() &&
+                   "qubits of a Pauli term must be distinct");
+            term.qubit_nums.push_back(qs.values[i]);
+            term.paulis.push_back(p);
+        }
+    }
+    assert(std::strlen(paulis) == qs.values.size());
+    terms_.push_back(std::move(term));
+    return *this;
+}
+
+builder::builder(qasm &ctx) : ctx_(ctx) {}
 
-builder::builder(const qasm &ctx, token tk) : ctx_(ctx) {
+builder::builder(qasm &ctx, token tk) : ctx_(ctx) {
     seq_.push_back(tk);
 }
 
@@ -106,7 +398,7 @@ builder builder::operator*(const builder &rhs) const {
 }
 
 void builder::operator()(const std::vector<int> &argv) const {
-    std::vector<int> pos_ctrls, neg_ctrls;
+    qcs::control_mask ctrls;
     double pow_exp = 1.0;
     bool invert = false;
     std::size_t arg_idx = 0;
@@ -114,10 +406,10 @@ void builder::operator()(const std::vector<int> &argv) const {
     for (const auto &t : seq_) {
         switch (t.kind) {
         case token::POS_CTRL:
-            pos_ctrls.push_back(argv[arg_idx++]);
+            ctrls.add(ctx_.slot(argv[arg_idx++]), true);
             break;
         case token::NEG_CTRL:
-            neg_ctrls.push_back(argv[arg_idx++]);
+            ctrls.add(ctx_.slot(argv[arg_idx++]), false);
             break;
         case token::POW:
             pow_exp *= t.val;
@@ -125,44 +417,24 @@ void builder::operator()(const std::vector<int> &argv) const {
         case token::INV:
             invert = !invert;
             break;
-        case token::X: {
-            double exp = pow_exp * (invert ? -1.0 : 1.0);
-            assert(ctx_.simulator_ && "simulator not registered");
-            if (exp == 1.0) {
-                ctx_.simulator_->gate_x(argv[arg_idx++], std::move(neg_ctrls), std::move(pos_ctrls));
-            } else {
-                ctx_.simulator_->gate_x_pow(exp, argv[arg_idx++], std::move(neg_ctrls), std::move(pos_ctrls));
-            }
-            pos_ctrls.clear();
-            neg_ctrls.clear();
-            pow_exp = 1.0;
-            invert = false;
-            break;
-        }
-        case token::HADAMARD: {
-            double exp = pow_exp * (invert ? -1.0 : 1.0);
-            assert(ctx_.simulator_ && "simulator not registered");
-            if (exp==1.0) {
-                ctx_.simulator_->hadamard(argv[arg_idx++], std::move(neg_ctrls), std::move(pos_ctrls));
-            } else {
-                ctx_.simulator_->hadamard_pow(exp, argv[arg_idx++], std::move(neg_ctrls), std::move(pos_ctrls));
-            }
-            pos_ctrls.clear();
-            neg_ctrls.clear();
-            pow_exp = 1.0;
-            invert = false;
-            break;
-        }
+        case token::X:
+        case token::HADAMARD:
         case token::U4: {
-            double exp = pow_exp * (invert ? -1.0 : 1.0);
-            assert(ctx_.simulator_ && "simulator not registered");
-            if (exp==1.0) {
-                ctx_.simulator_->gate_u4(t.theta, t.phi, t.lambda, t.gamma, argv[arg_idx++], std::move(neg_ctrls), std::move(pos_ctrls));
-            } else {
-                ctx_.simulator_->gate_u4_pow(t.theta, t.phi, t.lambda, t.gamma, exp, argv[arg_idx++], std::move(neg_ctrls), std::move(pos_ctrls));
+            instruction in(t.kind == token::X ? instruction::X
+                           : t.kind == token::HADAMARD ? instruction::HADAMARD
+                           : instruction::U4,
+                           ctx_.gate_slot(argv[arg_idx++]));
+            in.exponent = pow_exp * (invert ? -1.0 : 1.0);
+            in.theta = t.theta;
+            in.phi = t.phi;
+            in.lambda = t.lambda;
+            in.gamma = t.gamma;
+            if (ctrls.contains(in.target)) {
+                throw std::invalid_argument("control qubit is also the target");
             }
-            pos_ctrls.clear();
-            neg_ctrls.clear();
+            in.ctrls = std::move(ctrls);
+            ctx_.execute(std::move(in));
+            ctrls = qcs::control_mask();
             pow_exp = 1.0;
             invert = false;
             break;
@@ -182,10 +454,314 @@ void builder::append_arg(std::vector<int> &out, const indices_t &idx) {
 
 void builder::append_args(std::vector<int> &) {}
 
+qasm::~qasm() {
+    delete program_;
+}
+
 void qasm::register_simulator(qcs::simulator *sim) noexcept {
     simulator_ = sim;
 }
 
+void qasm::execute(instruction &&in) {
+    if (recording_) {
+        program_->code.push_back(std::move(in));
+        return;
+    }
+    assert(simulator_ && "simulator not registered");
+    dispatch(*simulator_, in, nullptr);
+}
+
+void qasm::record() {
+    // 記録した命令列は qubit を 0 番スロットから割り当てる前提で、
+    // 登録済みシミュレータにそのまま再生する
+    if (program_ != nullptr || num_slots_ != 0) {
+        throw std::runtime_error("circuit can be recorded only once per instance, before any qubit is used");
+    }
+    program_ = new program;
+    recording_ = true;
+    try {
+        circuit();
+    } catch (...) {
+        recording_ = false;
+        throw;
+    }
+    recording_ = false;
+}
+
+int qasm::slot(int qubit) {
+    assert(0 <= qubit && qubit < static_cast<int>(slot_of_.size()));
+    int &s = slot_of_[qubit];
+    assert(s != released && "qubit used after qfree");
+    if (s == unmapped) {
+        // スロットは常に 0..num_slots_-1 に詰めて使うので、新しい qubit は最上位に置く
+        s = num_slots_++;
+        execute(instruction(instruction::ATTACH, s));
+    }
+    return s;
+}
+
+// ゲートの標的になった qubit は基底状態とは限らなくなる（制御 qubit は変化しない）
+int qasm::gate_slot(int qubit) {
+    int s = slot(qubit);
+    in_basis_[qubit] = 0;
+    return s;
+}
+
+void qasm::qfree(const qubits &qs) {
+    indices_t idx;
+    idx.values = qs.indices_;
+    qfree(idx);
+}
+
+void qasm::qfree(const indices_t &qs) {
+    // 一部だけ解放された状態を残さないよう、切り離す前に全 qubit を検査する
+    for (std::size_t i = 0; i < qs.values.size(); ++i) {
+        const int q = qs.values[i];
+        assert(0 <= q && q < static_cast<int>(slot_of_.size()));
+        assert(slot_of_[q] != released && "qubit freed twice");
+        assert(std::find(qs.values.begin(), qs.values.begin() + i, q) == qs.values.begin() + i && "qubit listed twice in qfree");
+        if (!in_basis_[q]) {
+            throw std::runtime_error("qfree requires a measured or reset qubit");
+        }
+    }
+    for (int q : qs.values) {
+        int &s = slot_of_[q];
+        if (s != unmapped) {
+            // シミュレータはスロット s を取り除いて上のスロットを 1 つずつ詰めるので、同じように番号を付け直す
+            const int freed = s;
+            execute(instruction(instruction::DETACH, freed));
+            for (int &other : slot_of_) {
+                if (other > freed) {
+                    --other;
+                }
+            }
+            --num_slots_;
+        }
+        s = released;
+    }
+}
+
+param qasm::parameter() {
+    return param{num_params_++};
+}
+
+std::vector<std::vector<int>> qasm::run_batch(const std::vector<std::vector<double>> &bindings) {
+    assert(simulator_ && "simulator not registered");
+    assert(!bindings.empty());
+    record();
+    for (const auto &b : bindings) {
+        if (static_cast<int>(b.size()) < num_params_) {
+            throw std::runtime_error("binding does not cover all parameters");
+        }
+    }
+
+    const std::size_t batch_size = bindings.size();
+    std::vector<std::vector<int>> out(batch_size);
+    batch_scope scope(*simulator_, static_cast<int>(batch_size));
+    for (const auto &in : program_->code) {
+        if (in.kind == instruction::MEASURE) {
+            std::vector<int> r = simulator_->measure_batch(in.target);
+            for (std::size_t k = 0; k < batch_size; ++k) {
+                out[k].push_back(r[k]);
+            }
+        } else if (in.kind == instruction::U4 && in.is_symbolic()) {
+            std::vector<double> th, ph, la, ga;
+            th.reserve(batch_size);
+            ph.reserve(batch_size);
+            la.reserve(batch_size);
+            ga.reserve(batch_size);
+            for (const auto &b : bindings) {
+                th.push_back(in.theta.value(b));
+                ph.push_back(in.phi.value(b));
+                la.push_back(in.lambda.value(b));
+                ga.push_back(in.gamma.value(b));
+            }
+            simulator_->gate_u4_batch(std::move(th), std::move(ph), std::move(la), std::move(ga), in.exponent, in.target, in.ctrls);
+        } else {
+            // パラメータを含まない命令はバッチ全体に一様に適用される
+            dispatch(*simulator_, in, nullptr);
+        }
+    }
+    return out;
+}
+
+std::map<std::vector<int>, int> qasm::run_trajectories(const noise_model &noise, int num_trajectories, int num_threads, std::uint64_t seed) {
+    assert(simulator_ && "simulator not registered");
+    assert(num_trajectories > 0 && num_threads > 0);
+    record();
+    const std::vector<step> steps = schedule(program_->code, noise);
+    std::vector<std::vector<int>> records(num_trajectories);
+
+    // 分岐した軌跡を受け取るワーカー。シミュレータはワーカー数だけ用意して使い回す
+    struct branch_job {
+        int trajectory;
+        std::size_t step_num;
+        qcs::simulator *sim;
+        bool copy_in_worker;
+        int pauli; // 分岐ステップで起きた誤り（DEPOLARIZING のとき。AMPLITUDE_DAMPING の分岐は常に減衰）
+    };
+    std::vector<std::unique_ptr<qcs::simulator>> sims;
+    std::vector<qcs::simulator *> free_sims;
+    std::deque<branch_job> jobs;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool done = false;
+    std::exception_ptr error;
+    for (int i = 0; i < num_threads; ++i) {
+        sims.emplace_back(new qcs::simulator);
+        sims.back()->set_log_stream(nullptr);
+        sims.back()->set_num_threads(1);
+        sims.back()->setup();
+        free_sims.push_back(sims.back().get());
+    }
+
+    auto worker = [&]() {
+        for (;;) {
+            branch_job job;
+            {
+                std::unique_lock<std::mutex> lk(mtx);
+                cv.wait(lk, [&] { return done || !jobs.empty(); });
+                if (jobs.empty()) {
+                    return;
+                }
+                job = jobs.front();
+                jobs.pop_front();
+            }
+            try {
+                if (job.copy_in_worker) {
+                    job.sim->copy_state(*simulator_);
+                }
+                job.sim->set_seed(seed ^ (static_cast<std::uint64_t>(job.trajectory) * 0x9E3779B97F4A7C15ull));
+                std::size_t p = job.step_num;
+                if (!job.copy_in_worker) {
+                    // 途中の分岐は共有状態の上で決めた誤りをそのまま適用し、次のステップから進める
+                    const step &st = steps[p++];
+                    if (st.kind == step::DEPOLARIZING) {
+                        apply_pauli(*job.sim, job.pauli, st.qubit);
+                    } else {
+                        job.sim->amplitude_damping(st.p, true, st.qubit);
+                    }
+                }
+                run_steps(*job.sim, steps, noise, seed, job.trajectory, p, records[job.trajectory]);
+            } catch (...) {
+                std::lock_guard<std::mutex> lk(mtx);
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lk(mtx);
+                free_sims.push_back(job.sim);
+            }
+            cv.notify_all();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_threads; ++i) {
+        threads.emplace_back(worker);
+    }
+
+    // 誤りが起きていない軌跡は登録済みシミュレータ上で共有して進め、
+    // 誤り（または測定）が起きた時点の状態をワーカーのシミュレータへコピーして分岐させる。
+    // 測定ステップでは共有状態がそれ以上進まないので、コピー自体もワーカーに任せて並列に行う。
+    // 途中の分岐では共有状態を進める前にコピーを終える必要があるため、呼び出し側で全スレッドを使ってコピーする。
+    auto branch = [&](int t, std::size_t p, bool final_step, int pauli) {
+        qcs::simulator *sim;
+        {
+            std::unique_lock<std::mutex> lk(mtx);
+            cv.wait(lk, [&] { return !free_sims.empty(); });
+            sim = free_sims.back();
+            free_sims.pop_back();
+        }
+        if (!final_step) {
+            sim->set_num_threads(num_threads);
+            sim->copy_state(*simulator_);
+            sim->set_num_threads(1);
+        }
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            jobs.push_back(branch_job{t, p, sim, final_step, pauli});
+        }
+        cv.notify_all();
+    };
+
+    try {
+        std::vector<int> shared(num_trajectories);
+        for (int t = 0; t < num_trajectories; ++t) {
+            shared[t] = t;
+        }
+        for (std::size_t p = 0; p < steps.size() && !shared.empty(); ++p) {
+            const step &st = steps[p];
+            std::vector<int> remaining;
+            remaining.reserve(shared.size());
+            if (st.kind == step::INSTRUCTION && st.in->kind == instruction::MEASURE) {
+                for (int t : shared) {
+                    branch(t, p, true, 0);
+                }
+            } else if (st.kind == step::INSTRUCTION) {
+                dispatch(*simulator_, *st.in, nullptr);
+                remaining.swap(shared);
+            } else if (st.kind == step::DEPOLARIZING) {
+                for (int t : shared) {
+                    const int pauli = pauli_error(st, seed, t, p);
+                    if (pauli != 0) {
+                        branch(t, p, false, pauli);
+                    } else {
+                        remaining.push_back(t);
+                    }
+                }
+            } else {
+                const double decay = decay_probability(*simulator_, st);
+                for (int t : shared) {
+                    if (sample(seed, t, p, 0) < decay) {
+                        branch(t, p, false, 0);
+                    } else {
+                        remaining.push_back(t);
+                    }
+                }
+                if (!remaining.empty()) {
+                    simulator_->amplitude_damping(st.p, false, st.qubit);
+                }
+            }
+            shared.swap(remaining);
+        }
+    } catch (...) {
+        std::lock_guard<std::mutex> lk(mtx);
+        if (!error) {
+            error = std::current_exception();
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        done = true;
+    }
+    cv.notify_all();
+    for (auto &th : threads) {
+        th.join();
+    }
+    for (auto &sim : sims) {
+        sim->dispose();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    std::map<std::vector<int>, int> counts;
+    for (const auto &r : records) {
+        ++counts[r];
+    }
+    return counts;
+}
+
+noise_model qasm::noise() {
+    return noise_model();
+}
+
+std::vector<std::vector<double>> qasm::bindings() {
+    return std::vector<std::vector<double>>();
+}
+
 builder qasm::h() {
     token tk{token::HADAMARD};
     return builder(*this, tk);
@@ -196,16 +772,16 @@ builder qasm::x() {
     return builder(*this, tk);
 }
 
-builder qasm::u(double th, double ph, double la) {
+builder qasm::u(angle th, angle ph, angle la) {
     token tk{token::U4};
     tk.theta = th;
     tk.phi = ph;
     tk.lambda = la;
-    tk.gamma = 0;
+    tk.gamma = 0.0;
     return builder(*this, tk);
 }
 
-builder qasm::cu(double th, double ph, double la, double ga) {
+builder qasm::cu(angle th, angle ph, angle la, angle ga) {
     token ctrl{token::POS_CTRL};
     token u4{token::U4};
     u4.theta = th;
@@ -257,16 +833,15 @@ bit qasm::clalloc(int n) {
 }
 
 void qasm::reset(const qubits &qs) {
-    assert(simulator_ && "simulator not registered");
-    for (int q : qs.indices_) {
-        simulator_->reset(q);
-    }
+    indices_t idx;
+    idx.values = qs.indices_;
+    reset(idx);
 }
 
 void qasm::reset(const indices_t &qs) {
-    assert(simulator_ && "simulator not registered");
     for (int q : qs.values) {
-        simulator_->reset(q);
+        execute(instruction(instruction::RESET, slot(q)));
+        in_basis_[q] = 1;
     }
 }
 
@@ -277,15 +852,118 @@ std::vector<int> qasm::measure(const qubits &qs) {
 }
 
 std::vector<int> qasm::measure(const indices_t &qs) {
-    assert(simulator_ && "simulator not registered");
     std::vector<int> out;
     out.reserve(qs.values.size());
     for (int q : qs.values) {
-        out.push_back(simulator_->measure(q));
+        instruction in(instruction::MEASURE, slot(q));
+        in_basis_[q] = 1;
+        if (recording_) {
+            // 記録中は測定値が確定しないため 0 を返す
+            execute(std::move(in));
+            out.push_back(0);
+        } else {
+            assert(simulator_ && "simulator not registered");
+            out.push_back(dispatch(*simulator_, in, nullptr));
+        }
+    }
+    if (!recording_) {
+        measured_.insert(measured_.end(), out.begin(), out.end());
     }
     return out;
 }
 
+double qasm::expectation(const observable &obs) {
+    assert(simulator_ && "simulator not registered");
+    if (recording_) {
+        throw std::runtime_error("expectation is not available while recording");
+    }
+
+    // まだ割り当てていない qubit は |0> なので、シミュレータへ渡さずにここで評価する:
+    // Z は +1、X / Y を含む項は 0。
+    std::vector<pauli_term> attached;
+    attached.reserve(obs.terms().size());
+    for (const auto &term : obs.terms()) {
+        pauli_term reduced;
+        reduced.coeff = term.coeff;
+        bool vanishes = false;
+        for (std::size_t i = 0; i < term.qubit_nums.size() && !vanishes; ++i) {
+            const int q = term.qubit_nums[i];
+            assert(0 <= q && q < static_cast<int>(slot_of_.size()));
+            assert(slot_of_[q] != released && "qubit used after qfree");
+            if (slot_of_[q] != unmapped) {
+                reduced.qubit_nums.push_back(q);
+                reduced.paulis.push_back(term.paulis[i]);
+            } else {
+                vanishes = (term.paulis[i] != 'Z');
+            }
+        }
+        if (!vanishes) {
+            attached.push_back(std::move(reduced));
+        }
+    }
+
+    // qubit-wise commuting なグループへ first-fit で振り分ける
+    struct group_t {
+        std::map<int, char> basis;
+        std::vector<const pauli_term *> terms;
+    };
+    std::vector<group_t> groups;
+    double value = 0.0;
+    for (const auto &term : attached) {
+        if (term.qubit_nums.empty()) {
+            value += term.coeff;
+            continue;
+        }
+        group_t *dst = nullptr;
+        for (auto &g : groups) {
+            bool commutes = true;
+            for (std::size_t i = 0; i < term.qubit_nums.size() && commutes; ++i) {
+                auto it = g.basis.find(term.qubit_nums[i]);
+                commutes = (it == g.basis.end() || it->second == term.paulis[i]);
+            }
+            if (commutes) {
+                dst = &g;
+                break;
+            }
+        }
+        if (dst == nullptr) {
+            groups.push_back(group_t());
+            dst = &groups.back();
+        }
+        for (std::size_t i = 0; i < term.qubit_nums.size(); ++i) {
+            dst->basis[term.qubit_nums[i]] = term.paulis[i];
+        }
+        dst->terms.push_back(&term);
+    }
+
+    for (const auto &g : groups) {
+        std::vector<int> x_qubits, y_qubits;
+        for (const auto &b : g.basis) {
+            if (b.second == 'X') {
+                x_qubits.push_back(slot(b.first));
+            } else if (b.second == 'Y') {
+                y_qubits.push_back(slot(b.first));
+            }
+        }
+        std::vector<std::vector<int>> parities;
+        parities.reserve(g.terms.size());
+        for (const pauli_term *t : g.terms) {
+            std::vector<int> parity;
+            parity.reserve(t->qubit_nums.size());
+            for (int q : t->qubit_nums) {
+                parity.push_back(slot(q));
+            }
+            parities.push_back(std::move(parity));
+        }
+        std::vector<double> r = simulator_->expectation(std::move(x_qubits), std::move(y_qubits), std::move(parities));
+        assert(r.size() == g.terms.size());
+        for (std::size_t i = 0; i < g.terms.size(); ++i) {
+            value += g.terms[i]->coeff * r[i];
+        }
+    }
+    return value;
+}
+
 void qasm::circuit() {
     throw std::runtime_error("circuit not implemented");
 }
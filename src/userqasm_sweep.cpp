@@ -0,0 +1,31 @@
+#include <qasm/qasm.hpp>
+#include <cmath>
+
+class userqasm : public qasm::qasm
+{
+public:
+    void circuit() {
+        using namespace qasm;
+        qubits q = qalloc(2);
+        bit clbit = clalloc(2);
+        reset(q);
+
+        param t = parameter();
+        u(t, 0, 0)(q[0]);
+        (ctrl() * x())(q[0], q[1]);
+        u(0.5 * t + M_PI / 2, 0, 0)(q[1]);
+        u(M_PI / 2 - t, 0, 0)(q[0]);
+        clbit = measure(q);
+    }
+
+    std::vector<std::vector<double>> bindings() {
+        constexpr int num_points = 8;
+        std::vector<std::vector<double>> out;
+        for (int i = 0; i < num_points; ++i) {
+            out.push_back({2 * M_PI * i / num_points});
+        }
+        return out;
+    }
+};
+
+extern "C" qasm::qasm* constructor() { return new userqasm(); }